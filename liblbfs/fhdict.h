@@ -0,0 +1,106 @@
+#ifndef _LBFS_FHDICT_H_
+#define _LBFS_FHDICT_H_
+
+// Fingerprint database records name their file by a small id rather
+// than by the file handle itself.  The handles live in a side table,
+// name.fh, as fixed size records: id n is record n-1.  Ids are never
+// reused; the table only grows.
+
+#include "async.h"
+#include "qhash.h"
+#include "fingerprint.h"
+
+// what the fingerprint database stores for each chunk
+struct fp_record {
+  u_int64_t pos;
+  u_int32_t count;
+  u_int32_t fileid;
+  u_int32_t stamp;
+  unsigned char hashrest[FP_HASHREST];
+};
+
+class fh_dict {
+  struct rec {
+    u_int32_t size;
+    unsigned char fh[NFS3_FHSIZE];
+  };
+
+  // in memory only: the ids with records, least recently used first.
+  // the links of id n are at n-1; 0 ends the list.
+  struct lrulink {
+    u_int32_t prev;
+    u_int32_t next;
+    bool linked;
+  };
+
+  int _fd;
+  vec<rec> _recs;
+  qhash<nfs_fh3, u_int32_t> _ids;
+  vec<lrulink> _lru;
+  u_int32_t _oldest;
+  u_int32_t _newest;
+
+  void lru_remove (u_int32_t id) {
+    lrulink &l = _lru[id - 1];
+    if (l.prev)
+      _lru[l.prev - 1].next = l.next;
+    else
+      _oldest = l.next;
+    if (l.next)
+      _lru[l.next - 1].prev = l.prev;
+    else
+      _newest = l.prev;
+    l.prev = l.next = 0;
+    l.linked = false;
+  }
+  void lru_append (u_int32_t id) {
+    lrulink &l = _lru[id - 1];
+    l.prev = _newest;
+    l.next = 0;
+    l.linked = true;
+    if (_newest)
+      _lru[_newest - 1].next = id;
+    else
+      _oldest = id;
+    _newest = id;
+  }
+
+public:
+  fh_dict () : _fd (-1), _oldest (0), _newest (0) {}
+  ~fh_dict () { close (); }
+
+  // returns an errno
+  int open (const char *name, bool truncate = false);
+  void close ();
+
+  // the id of fh, which is added if it is new; 0 on error
+  u_int32_t intern (const nfs_fh3 &fh);
+  u_int32_t intern (const unsigned char *fh, unsigned size);
+  // the id of fh, or 0 if it was never added
+  u_int32_t find (const nfs_fh3 &fh) const;
+  // the handle with id id, or NULL
+  const unsigned char *lookup (u_int32_t id, unsigned *size) const;
+
+  // records of id were added or looked at, for picking files to
+  // evict; ids not touched since open are oldest, in id order
+  void touch (u_int32_t id) {
+    if (!id || id > _lru.size () || id == _newest)
+      return;
+    if (_lru[id - 1].linked)
+      lru_remove (id);
+    lru_append (id);
+  }
+  // id has no records left; it is oldest again once touched
+  void forget (u_int32_t id) {
+    if (id && id <= _lru.size () && _lru[id - 1].linked)
+      lru_remove (id);
+  }
+  // the least and most recently used ids, 0 if there are none
+  u_int32_t oldest () const { return _oldest; }
+  u_int32_t newest () const { return _newest; }
+
+  int sync ();
+  size_t size () const { return _recs.size (); }
+};
+
+#endif /* _LBFS_FHDICT_H_ */
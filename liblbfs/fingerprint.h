@@ -11,11 +11,15 @@
 //
 //   f(A) mod K = x
 //
-// if we use K = 8192, the average chunk size is 8k. we allow multiple K
-// values so we can do multi-level chunking.
+// if we use K = 8192, the average chunk size is 8k.
+//
+// a second level groups chunks into super-chunks the same way, by
+// testing each chunk's hash instead of a window of bytes; see
+// SuperChunker.
 
 #include "vec.h"
 #include "sha1.h"
+#include "lbfs_sha1.h"
 #include "sfs_prot.h"
 #include "rabinpoly.h"
 
@@ -24,22 +28,43 @@
 #define MIN_CHUNK_SIZE  2048
 #define MAX_CHUNK_SIZE  65535
 
+// databases are keyed by the first 8 bytes of a chunk's hash; records
+// keep the rest
+#define FP_HASHREST     (sha1::hashsize - sizeof(u_int64_t))
+
+// a stamp for the version of a file a location was found in, e.g. a
+// name that changes whenever the file does.  0 means no stamp.
+inline u_int32_t
+fp_stamp(const char *s)
+{
+  u_int32_t h = 2166136261U;
+  while (*s)
+    h = (h ^ (unsigned char) *s++) * 16777619;
+  return h ? h : 1;
+}
+
 class chunk_location {
 private:
   off_t _pos;
   size_t _count;
+  u_int32_t _stamp;
+  unsigned char _hrest[FP_HASHREST];
   unsigned _fhsize;
   unsigned char _fh[NFS3_FHSIZE];
 
 public:
   chunk_location() {
     _fhsize = 0;
+    _stamp = 0;
+    bzero(_hrest, FP_HASHREST);
   }
   
   chunk_location(off_t p, size_t c) {
     _fhsize = 0;
     _pos = p;
     _count = c;
+    _stamp = 0;
+    bzero(_hrest, FP_HASHREST);
   }
 
   chunk_location& operator= (const chunk_location &l) {
@@ -47,13 +72,20 @@ public:
     if (_fhsize > 0) memmove(_fh, l._fh, _fhsize);
     _pos = l._pos;
     _count = l._count;
+    _stamp = l._stamp;
+    memcpy(_hrest, l._hrest, FP_HASHREST);
     return *this;
   }
   
   void set_fh(const nfs_fh3 &f) {
+    set_fh(reinterpret_cast<const unsigned char *>(f.data.base()),
+	   f.data.size());
+  }
+
+  void set_fh(const unsigned char *fh, unsigned size) {
     bzero(_fh, NFS3_FHSIZE);
-    memmove(_fh, f.data.base(), f.data.size());
-    _fhsize = f.data.size();
+    memmove(_fh, fh, size);
+    _fhsize = size;
   }
 
   int get_fh(nfs_fh3 &f) const {
@@ -67,6 +99,35 @@ public:
       return -1;
   }
 
+  u_int32_t stamp() const		{ return _stamp; }
+  void set_stamp(u_int32_t s)		{ _stamp = s; }
+
+  const unsigned char *hash_rest() const { return _hrest; }
+  void set_hash_rest(const unsigned char *r) { memcpy(_hrest, r, FP_HASHREST); }
+  void set_hash(const sfs_hash &h) {
+    set_hash_rest(reinterpret_cast<const unsigned char *>(h.base()) +
+		  sizeof(u_int64_t));
+  }
+  // false if this location is known to hold some chunk other than h;
+  // the first 8 bytes are the key the location was found under
+  bool hash_maybe(const sfs_hash &h) const {
+    static const unsigned char none[FP_HASHREST] = { 0 };
+    return !memcmp(_hrest, none, FP_HASHREST) ||
+      !memcmp(_hrest, h.base() + sizeof(u_int64_t), FP_HASHREST);
+  }
+
+  const unsigned char *fh_base() const { return _fh; }
+  unsigned fh_size() const { return _fhsize; }
+
+  bool fh_eq(const nfs_fh3 &f) const {
+    return _fhsize == f.data.size() && !memcmp(_fh, f.data.base(), _fhsize);
+  }
+
+  bool operator== (const chunk_location &l) const {
+    return _pos == l._pos && _count == l._count && _fhsize == l._fhsize &&
+      !memcmp(_fh, l._fh, _fhsize);
+  }
+
 #if WITH_PATH
   void set_path(const char *p) {
     strcpy (_path, p);
@@ -82,45 +143,44 @@ public:
   void set_count(size_t c) 	{ _count = c; }
 
   size_t size() const { 
-    return sizeof(off_t)+sizeof(size_t)+sizeof(unsigned)+_fhsize;
+    return sizeof(off_t)+sizeof(size_t)+sizeof(u_int32_t)+FP_HASHREST+
+      sizeof(unsigned)+_fhsize;
   }
 };
 
+// what the chunker produces: chunks are kept by value in a vec, so a
+// chunk vector is one contiguous array.  which file the chunks belong
+// to is up to the caller; see chunk_location for the database record.
 class chunk {
 private:
-  chunk_location _loc;
+  u_int64_t _pos;
+  u_int32_t _count;
   sfs_hash _hash;
   
-  void compute_hash(unsigned char *data, unsigned count) {
-    sha1_hash(_hash.base(), data, count); 
+  void compute_hash(const unsigned char *data, unsigned count) {
+    lbfs_sha1_hash(_hash.base(), data, count); 
   }
 
 public:
-  chunk(off_t p, size_t s, sfs_hash h)
-    : _loc(p, s), _hash(h)
+  chunk() : _pos(0), _count(0) {}
+
+  chunk(u_int64_t p, size_t s, const sfs_hash &h)
+    : _pos(p), _count(s), _hash(h)
   {
   }
   
-  chunk(off_t p, size_t s, unsigned char *data)
-    : _loc(p, s)
+  chunk(u_int64_t p, size_t s, const unsigned char *data)
+    : _pos(p), _count(s)
   {
     compute_hash(data, s);
   }
-  
-  chunk(chunk &c) 
-  {
-    _loc = c._loc;
-    _hash = c._hash;
-  }
 
-  chunk& operator= (const chunk &c)
-  {
-    _loc = c._loc;
-    _hash = c._hash;
-    return *this;
-  }
+  u_int64_t pos() const		{ return _pos; }
+  void set_pos(u_int64_t p)	{ _pos = p; }
+  size_t count() const 		{ return _count; }
+  u_int64_t end() const		{ return _pos + _count; }
 
-  sfs_hash hash() const { return _hash; }
+  const sfs_hash &hash() const { return _hash; }
 
   u_int64_t hashidx() const {
     u_int64_t n;
@@ -128,16 +188,28 @@ public:
     return n;
   }
   
-  bool hash_eq(sfs_hash &h) const { 
+  bool hash_eq(const sfs_hash &h) const { 
     return memcmp(h.base(), _hash.base(), sha1::hashsize) == 0; 
   }
 
-  chunk_location& location() { return _loc; }
+  // the database record for this chunk in file fh
+  chunk_location location(const nfs_fh3 &fh, u_int32_t stamp = 0) const {
+    chunk_location l(_pos, _count);
+    l.set_fh(fh);
+    l.set_hash(_hash);
+    l.set_stamp(stamp);
+    return l;
+  }
 };
 
 u_int64_t fingerprint(const unsigned char *data, size_t count);
-int chunk_data(vec<chunk *>& cvp, const unsigned char *data, size_t count);
-int chunk_file(vec<chunk *>& cvp, const char *path);
+int chunk_data(vec<chunk>& cvp, const unsigned char *data, size_t count);
+int chunk_file(vec<chunk>& cvp, const char *path);
+
+// chunk_fd chunks the whole file from offset 0, whatever the fd's
+// position; files of at least two segments are chunked on several threads
+#define PCHUNK_MIN_SEGMENT (8<<20)
+int chunk_fd(vec<chunk>& cvp, int fd, unsigned nthreads = 0);
 
 class Chunker {
 private:
@@ -160,12 +232,13 @@ private:
   size_t _cur_pos;
   struct prefetched_buffer *_pfb;
   
-  unsigned char *_hbuf; 
-  unsigned int _hbuf_size;
-  unsigned int _hbuf_cursor;
+  lbfs_sha1ctx _hctx;	// hash of the bytes of the current chunk seen so far
+  size_t _hlen;
 
-  vec<chunk *> _cv;
+  vec<chunk> _cv;
   void handle_hash(const unsigned char *data, size_t size);
+  void new_chunk();
+  size_t scan(const unsigned char *data, size_t size);
 
 public:
   Chunker();
@@ -176,20 +249,63 @@ public:
   void chunk_data (const unsigned char *data, size_t size);
   void chunk_data (const unsigned char *data, uint64 off, size_t size);
 
-  const vec<chunk*>& chunk_vector() { return _cv; }
-  void copy_chunk_vector(vec<chunk*>&);
+  const vec<chunk>& chunk_vector() const { return _cv; }
+  void copy_chunk_vector(vec<chunk>&) const;
   
   static const unsigned chunk_size = 2048;
-  static unsigned min_size_suppress;
-  static unsigned max_size_suppress;
+  unsigned min_size_suppress;	// per Chunker, so workers can run at once
+  unsigned max_size_suppress;
+};
+
+// A super-chunk is a run of chunks.  A run ends after a chunk whose
+// hash ends in SUPERCHUNK_BITS zero bits, so, like chunk boundaries,
+// super-chunk boundaries move with the data and an edit only disturbs
+// the run it falls in.  Runs are also cut at SUPERCHUNK_MAXCHUNKS
+// chunks and before they grow past SUPERCHUNK_MAXBYTES.
+//
+// A super-chunk's hash is the SHA-1 of its chunks' hashes, in order;
+// a run of one chunk has that chunk's hash.
+#define SUPERCHUNK_BITS      4		// 16 chunks in a run on average
+#define SUPERCHUNK_MAXCHUNKS 64
+#define SUPERCHUNK_MAXBYTES  (1<<20)
+
+struct superchunk {
+  u_int64_t pos;
+  u_int64_t count;		// bytes
+  u_int32_t index;		// of the first chunk
+  u_int32_t nchunks;
+  sfs_hash hash;
+};
+
+void superchunk_hash(sfs_hash &h, const vec<chunk>& cv);
+
+class SuperChunker {
+private:
+  lbfs_sha1ctx _hctx;	// over the hashes of the current run's chunks
+  sfs_hash _first;
+  superchunk _cur;
+  vec<superchunk> _sv;
+  void end_super();
+
+public:
+  SuperChunker();
+
+  // the next chunk of the file
+  void add(size_t count, const sfs_hash &h);
+  void stop();
+  const vec<superchunk>& super_vector() const { return _sv; }
+
+  static bool is_break(const sfs_hash &h) {
+    return !(h.base()[sha1::hashsize - 1] & ((1 << SUPERCHUNK_BITS) - 1));
+  }
 };
 
 inline void
-Chunker::copy_chunk_vector(vec<chunk*>& cvp)
+Chunker::copy_chunk_vector(vec<chunk>& cvp) const
 {
   cvp.setsize(_cv.size());
-  for (unsigned i=0; i<_cv.size(); i++)
-    cvp[i] = New chunk(*(_cv[i]));
+  if (_cv.size())
+    memcpy(cvp.base(), _cv.base(), _cv.size() * sizeof(chunk));
 }
 
 #endif _CHUNKING_H_
@@ -0,0 +1,57 @@
+#ifndef _LBFS_FPFILTER_H_
+#define _LBFS_FPFILTER_H_
+
+// A counting Bloom filter over fingerprint database keys.  maybe()
+// never says no for a key that was added and not removed, so a "no"
+// lets a lookup skip the database.  Counters are four bits and stick
+// once they reach 15; such a counter can never produce a false "no".
+
+#include "async.h"
+
+struct fpfilter_stats {
+  u_int64_t hits;		// maybe, and the database had it
+  u_int64_t falsepos;		// maybe, but the database did not
+  u_int64_t rejects;		// lookups the database never saw
+
+  fpfilter_stats () : hits (0), falsepos (0), rejects (0) {}
+  void report (const char *who) const;
+};
+
+class fpfilter {
+  u_int8_t *_ctr;		// two counters per byte
+  u_int64_t _mask;		// number of counters - 1
+  unsigned _k;			// counters per key
+  u_int64_t _n;			// keys in the filter
+  u_int64_t _cap;		// keys the filter was sized for
+
+  u_int64_t slot (u_int64_t key, unsigned i) const {
+    // keys are already pieces of sha1 hashes; double hashing is enough
+    u_int64_t h2 = (key * INT64(0x9e3779b97f4a7c15)) >> 32 | 1;
+    return (key + i * h2) & _mask;
+  }
+  unsigned get (u_int64_t s) const { return _ctr[s >> 1] >> (s & 1) * 4 & 0xf; }
+  void set (u_int64_t s, unsigned v) {
+    u_int8_t &b = _ctr[s >> 1];
+    b = (b & ~(0xf << (s & 1) * 4)) | v << (s & 1) * 4;
+  }
+
+public:
+  fpfilter_stats stats;
+
+  fpfilter () : _ctr (0), _mask (0), _k (0), _n (0), _cap (0) {}
+  ~fpfilter () { clear (); }
+
+  // room for capacity keys at false positive rate fprate
+  void init (u_int64_t capacity, double fprate);
+  void clear ();
+
+  bool enabled () const { return _ctr; }
+  bool full () const { return _n > _cap; }
+  u_int64_t capacity () const { return _cap; }
+
+  void add (u_int64_t key);
+  void remove (u_int64_t key);
+  bool maybe (u_int64_t key) const;
+};
+
+#endif /* _LBFS_FPFILTER_H_ */
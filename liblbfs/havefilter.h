@@ -0,0 +1,45 @@
+#ifndef _LBFS_HAVEFILTER_H_
+#define _LBFS_HAVEFILTER_H_
+
+// The chunks a client already has, as it sends them with GETFPDATA: a
+// Bloom filter of 8 * nbytes bits with k probes per chunk.  Probes are
+// taken from the first eight bytes of a chunk's SHA-1 hash, read in
+// network byte order, so both ends agree whatever their byte order.
+// An fp_db key holds exactly those eight bytes.
+
+#include "async.h"
+
+inline u_int64_t
+lbfs_have_slot (const void *hash, unsigned i, u_int64_t nbits)
+{
+  const u_char *p = static_cast<const u_char *> (hash);
+  u_int32_t a = p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+  u_int32_t b = (p[4] << 24 | p[5] << 16 | p[6] << 8 | p[7]) | 1;
+  return (a + (u_int64_t) i * b) % nbits;
+}
+
+inline void
+lbfs_have_add (char *bits, size_t nbytes, unsigned k, const void *hash)
+{
+  for (unsigned i = 0; i < k; i++) {
+    u_int64_t s = lbfs_have_slot (hash, i, (u_int64_t) nbytes * 8);
+    bits[s >> 3] |= 1 << (s & 7);
+  }
+}
+
+// false if the client certainly lacks the chunk
+inline bool
+lbfs_have_maybe (const char *bits, size_t nbytes, unsigned k,
+                 const void *hash)
+{
+  if (!nbytes)
+    return false;
+  for (unsigned i = 0; i < k; i++) {
+    u_int64_t s = lbfs_have_slot (hash, i, (u_int64_t) nbytes * 8);
+    if (!(bits[s >> 3] & 1 << (s & 7)))
+      return false;
+  }
+  return true;
+}
+
+#endif /* _LBFS_HAVEFILTER_H_ */
@@ -72,6 +72,151 @@ default:
 	ex_post_op_attr resfail;
 };
 
+const LBFS_MAXGETFPX = 1024;
+
+/*
+ * GETFP by chunk index: fingerprints index through index+count-1 of
+ * the file.  The server chunks the whole file once, so a client can
+ * have many of these outstanding without knowing where chunks start.
+ * Fewer than count come back only at the end of the file.
+ */
+struct lbfs_getfpx3args {
+  nfs_fh3 file;
+  uint32 index;
+  uint32 count;
+};
+
+struct lbfs_getfpx3resok {
+  ex_post_op_attr file_attributes;
+  uint64 offset;		/* where fprints[0] starts */
+  lbfs_fp3 fprints<LBFS_MAXGETFPX>;
+  bool eof;
+};
+
+union lbfs_getfpx3res switch (nfsstat3 status) {
+case NFS3_OK:
+	lbfs_getfpx3resok resok;
+default:
+	ex_post_op_attr resfail;
+};
+
+const LBFS_MAXGETSFP = 1024;
+
+/*
+ * GETFPX one level up: super-chunks index through index+count-1 (see
+ * SuperChunker in fingerprint.h).  A client that already has a run of
+ * chunks with a super-chunk's hash needs nothing more; otherwise it
+ * asks for the run's chunks with GETFPX.
+ */
+struct lbfs_sfp3 {
+  uint32 index;			/* chunk index of the first chunk */
+  uint32 nchunks;
+  uint32 count;			/* bytes */
+  sfs_hash hash;
+};
+
+struct lbfs_getsfp3resok {
+  ex_post_op_attr file_attributes;
+  uint64 offset;		/* where sfprints[0] starts */
+  lbfs_sfp3 sfprints<LBFS_MAXGETSFP>;
+  bool eof;
+};
+
+union lbfs_getsfp3res switch (nfsstat3 status) {
+case NFS3_OK:
+	lbfs_getsfp3resok resok;
+default:
+	ex_post_op_attr resfail;
+};
+
+const LBFS_MAXHAVE = 16384;
+
+/*
+ * GETFPX that also returns the data of chunks the client lacks.  have
+ * is a Bloom filter of the chunks the client holds (see havefilter.h),
+ * nprobes its probes per chunk.  The server sends along the data of at
+ * most maxdata bytes' worth of chunks missing from the filter.  The
+ * encoded chunks array, fingerprints and data alike, never takes more
+ * than LBFS_MAXFPDATA bytes, whatever maxdata says, so a reply is no
+ * bigger than that of a READ of as many bytes.
+ */
+const LBFS_MAXFPDATA = 65536;
+
+struct lbfs_getfpdata3args {
+  lbfs_getfpx3args fpx;
+  uint32 maxdata;
+  uint32 nprobes;
+  opaque have<LBFS_MAXHAVE>;
+};
+
+struct lbfs_fpdata3 {
+  lbfs_fp3 fp;
+  opaque data<>;		/* empty unless sent */
+};
+
+struct lbfs_getfpdata3resok {
+  ex_post_op_attr file_attributes;
+  uint64 offset;		/* where chunks[0] starts */
+  lbfs_fpdata3 chunks<LBFS_MAXGETFPX>;
+  bool eof;
+};
+
+union lbfs_getfpdata3res switch (nfsstat3 status) {
+case NFS3_OK:
+	lbfs_getfpdata3resok resok;
+default:
+	ex_post_op_attr resfail;
+};
+
+/*
+ * The data of the chunk with the given hash.  file and offset say
+ * where the client expects it, but the server may find it anywhere.
+ */
+struct lbfs_readchunk3args {
+  nfs_fh3 file;
+  uint64 offset;
+  uint32 count;
+  sfs_hash hash;
+};
+
+struct lbfs_readchunk3resok {
+  opaque data<>;
+};
+
+union lbfs_readchunk3res switch (nfsstat3 status) {
+case NFS3_OK:
+	lbfs_readchunk3resok resok;
+default:
+	void;
+};
+
+const LBFS_MAXCONDWRITEV = 512;
+
+struct lbfs_cwchunk {
+  uint64 offset;
+  uint32 count;
+  sfs_hash hash;
+};
+
+/* CONDWRITE for many chunks of the same temporary file */
+struct lbfs_condwritev3args {
+  nfs_fh3 commit_to;
+  unsigned fd;
+  lbfs_cwchunk chunks<LBFS_MAXCONDWRITEV>;
+};
+
+/* bit i % 8 of byte i / 8 is set when chunks[i] was not written */
+struct lbfs_condwritev3resok {
+  opaque missing<>;
+};
+
+union lbfs_condwritev3res switch (nfsstat3 status) {
+case NFS3_OK:
+	lbfs_condwritev3resok resok;
+default:
+	void;
+};
+
 program LBFS_PROGRAM {
 	version LBFS_V3 {
 		void
@@ -158,6 +303,21 @@ program LBFS_PROGRAM {
 		lbfs_getfp3res
 		lbfs_GETFP (lbfs_getfp3args) = 27;
 
+		lbfs_condwritev3res
+		lbfs_CONDWRITEV (lbfs_condwritev3args) = 28;
+
+		lbfs_getfpx3res
+		lbfs_GETFPX (lbfs_getfpx3args) = 29;
+
+		lbfs_getfpdata3res
+		lbfs_GETFPDATA (lbfs_getfpdata3args) = 30;
+
+		lbfs_readchunk3res
+		lbfs_READCHUNK (lbfs_readchunk3args) = 31;
+
+		lbfs_getsfp3res
+		lbfs_GETSFP (lbfs_getfpx3args) = 32;
+
 	} = 3;
 } = 344444;
 
@@ -0,0 +1,30 @@
+#ifndef _LBFS_SHA1_H_
+#define _LBFS_SHA1_H_
+
+// SHA-1 for chunk hashing.  On CPUs with the x86 SHA extensions the
+// compression function runs in hardware; everywhere else these are thin
+// wrappers around the sha1ctx and sha1_hash in sfs.  Either way the
+// output is plain SHA-1.
+
+#include "sha1.h"
+
+bool lbfs_sha1_hw ();		// true if the SHA extensions are usable
+const char *lbfs_sha1_impl ();
+void lbfs_sha1_hash (void *digest, const void *data, size_t len);
+
+class lbfs_sha1ctx {
+  bool _hw;
+  u_int32_t _state[5];
+  u_int64_t _count;
+  unsigned char _buf[sha1::blocksize];
+  sha1ctx _sctx;	// used when there is no hardware support
+
+public:
+  // hw = false forces the generic code, e.g. to check one against the other
+  lbfs_sha1ctx (bool hw = true) : _hw (hw && lbfs_sha1_hw ()) { reset (); }
+  void reset ();
+  void update (const void *data, size_t len);
+  void final (void *digest);
+};
+
+#endif /* _LBFS_SHA1_H_ */
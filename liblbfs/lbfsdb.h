@@ -6,6 +6,7 @@
 #else /* !HAVE_DB3_H */
 #include <db.h>
 #endif /* !HAVE_DB3_H */
+#include <sys/stat.h>
 
 template<class K, class V> class db_base {
 private:
@@ -34,6 +35,20 @@ public:
     operator bool() const { return _cursor != 0; }
     int del() { return _cursor->c_del(_cursor, 0); }
 
+    // key of the current entry
+    int get_key(K *k) {
+      if (!_cursor) 
+	return -1;
+      DBT key;
+      DBT data;
+      memset(&key, 0, sizeof(key));
+      memset(&data, 0, sizeof(data));
+      int ret = _cursor->c_get(_cursor, &key, &data, DB_CURRENT);
+      if (ret == 0)
+        *k = *(reinterpret_cast<K*>(key.data));
+      return ret;
+    }
+
     // get current entry
     int get(V *c) {
       if (!_cursor) 
@@ -89,10 +104,33 @@ public:
   // add an entry to the database, returns db3 errnos
   int add_entry(K key, V *val, int size = sizeof(V));
 
+  // add n entries at once, keys[i] with vals[i] of sizes[i] bytes (or
+  // sizeof(V) if sizes is NULL).  the entries go in in key order
+  // through a single cursor.
+  int add_entries(size_t n, const K *keys, V *vals, const int *sizes = 0);
+
+  // number of entries, from DB->stat; 0 if that fails
+  u_int64_t count();
+
   // sync data to stable storage
   int sync();
 };
 
+// sorts batches into the order of the db3 btree, which compares keys
+// as bytes; equal keys stay in the order they were given
+template<class K> struct db_sortent {
+  K key;
+  size_t idx;
+
+  static int cmp(const void *a, const void *b) {
+    const db_sortent *x = static_cast<const db_sortent *>(a);
+    const db_sortent *y = static_cast<const db_sortent *>(b);
+    if (int r = memcmp(&x->key, &y->key, sizeof(K)))
+      return r;
+    return x->idx < y->idx ? -1 : x->idx > y->idx;
+  }
+};
+
 template<class K, class V>
 inline int
 db_base<K,V>::sync()
@@ -100,6 +138,23 @@ db_base<K,V>::sync()
   return _dbp->sync(_dbp,0);
 }
 
+template<class K, class V>
+inline u_int64_t
+db_base<K,V>::count()
+{
+  DB_BTREE_STAT *sp = 0;
+#if DB_VERSION_MAJOR == 3 && DB_VERSION_MINOR < 3
+  int ret = _dbp->stat(_dbp, &sp, NULL, 0);
+#else
+  int ret = _dbp->stat(_dbp, &sp, 0);
+#endif
+  if (ret || !sp)
+    return 0;
+  u_int64_t n = sp->bt_ndata;
+  free(sp);
+  return n;
+}
+
 template<class K, class V>
 inline 
 db_base<K,V>::db_base()
@@ -195,10 +250,620 @@ db_base<K,V>::add_entry(K k, V *v, int size)
   return _dbp->put(_dbp, NULL, &key, &data, 0);
 }
 
+template<class K, class V>
+inline int
+db_base<K,V>::add_entries(size_t n, const K *keys, V *vals, const int *sizes)
+{
+  if (!n)
+    return 0;
+  DBC *cursor;
+  int ret;
+  if ((ret = _dbp->cursor(_dbp, NULL, &cursor, 0)) != 0)
+    return ret;
+
+  db_sortent<K> *order = New db_sortent<K>[n];
+  for (size_t i = 0; i < n; i++) {
+    order[i].key = keys[i];
+    order[i].idx = i;
+  }
+  qsort(order, n, sizeof(order[0]), &db_sortent<K>::cmp);
+
+  for (size_t i = 0; i < n && ret == 0; i++) {
+    size_t j = order[i].idx;
+    DBT key;
+    memset(&key, 0, sizeof(key));
+    key.data = reinterpret_cast<void *>(&order[i].key);
+    key.size = sizeof(K);
+    DBT data;
+    memset(&data, 0, sizeof(data));
+    data.data = reinterpret_cast<void *>(&vals[j]);
+    data.size = sizes ? sizes[j] : sizeof(V);
+    ret = cursor->c_put(cursor, &key, &data, DB_KEYLAST);
+  }
+  delete[] order;
+  cursor->c_close(cursor);
+  return ret;
+}
+
 #include "fingerprint.h"
+#include "fhdict.h"
 extern const char *CLI_FPDB;
 extern const char *SRV_FPDB;
-typedef db_base<u_int64_t, chunk_location> fp_db;
+extern const char *SRV_MANIFESTS;
+#ifdef LBFS_MMAPDB
+#include "mmapdb.h"
+typedef mmap_db<u_int64_t, fp_record> fp_db_engine;
+typedef mmap_db<u_int32_t, u_int64_t> fp_rev_engine;
+#else /* !LBFS_MMAPDB */
+typedef db_base<u_int64_t, fp_record> fp_db_engine;
+typedef db_base<u_int32_t, u_int64_t> fp_rev_engine;
+#endif /* !LBFS_MMAPDB */
 
-#endif _LBFS_DB_
+#include "fpfilter.h"
+
+// The fingerprint database, with a Bloom filter in front of it so that
+// lookups of chunks nobody has seen never reach the database.  The
+// filter is built from the database when it is opened and follows
+// add_entry and iterator::del.  LBFS_FPFILTER in the environment sets
+// the false positive rate the filter is sized for (default 0.01); 0
+// turns the filter off.
+//
+// Callers deal in chunk_locations.  The database itself stores
+// fp_records, which name the file by its id in the fh_dict kept next
+// to the database in name.fh.
+//
+// name.rev maps file ids back to the keys of their records, so del_fh
+// only visits the records of the file going away.  Entries there can
+// outlive the records they point at (iterator::del doesn't chase
+// them); del_fh skips those and removes them along with the rest.
+//
+// With set_max, adding past that many records evicts whole files, the
+// ones whose records were added or looked at least recently, until a
+// tenth of the room is free again.
+class fp_db {
+  typedef u_int64_t K;
+  typedef chunk_location V;
+
+  fp_db_engine _db;
+  fp_rev_engine _rev;
+  fh_dict _fhs;
+  fpfilter _filter;
+  double _fprate;
+  u_int64_t _nrecs;		// known when a filter or _max needs it
+  u_int64_t _max;
+
+  void build_filter();
+  void evict();
+  u_int64_t del_id(u_int32_t id, u_int32_t keep, u_int64_t *nchecked);
+  int build_rev();
+  int open_rev(const char *name, bool truncate);
+  int rev_add(size_t n, const K *keys, const fp_record *recs) {
+    u_int32_t *ids = New u_int32_t[n];
+    K *vals = New K[n];
+    for (size_t i = 0; i < n; i++) {
+      ids[i] = recs[i].fileid;
+      vals[i] = keys[i];
+    }
+    int ret = _rev.add_entries(n, ids, vals);
+    delete[] ids;
+    delete[] vals;
+    return ret;
+  }
+  void filter_add(size_t n, const K *keys) {
+    if (!_filter.enabled())
+      return;
+    for (size_t i = 0; i < n; i++)
+      _filter.add(keys[i]);
+    if (_filter.full())
+      build_filter();
+  }
+  void grown(size_t n) {
+    _nrecs += n;
+    if (_max && _nrecs > _max)
+      evict();
+  }
+  int open_fhs(const char *name, bool truncate);
+  bool to_record(const V &l, fp_record *r) {
+    r->pos = l.pos();
+    r->count = l.count();
+    r->stamp = l.stamp();
+    memcpy(r->hashrest, l.hash_rest(), FP_HASHREST);
+    r->fileid = _fhs.intern(l.fh_base(), l.fh_size());
+    _fhs.touch(r->fileid);
+    return r->fileid != 0;
+  }
+  void from_record(const fp_record &r, V *l) const {
+    unsigned size = 0;
+    const unsigned char *fh = _fhs.lookup(r.fileid, &size);
+    l->set_pos(r.pos);
+    l->set_count(r.count);
+    l->set_stamp(r.stamp);
+    l->set_hash_rest(r.hashrest);
+    l->set_fh(fh ? fh : reinterpret_cast<const unsigned char *>(""), size);
+  }
+
+public:
+  class iterator {
+    friend class fp_db;
+
+  private:
+    fp_db *_fdb;
+    fp_db_engine::iterator *_it;
+    iterator(fp_db *fdb, fp_db_engine::iterator *it) : _fdb(fdb), _it(it) {}
+
+  public:
+    ~iterator() { delete _it; }
+
+    operator bool() const { return *_it; }
+    int del() {
+      K k;
+      if (_it->get_key(&k) == 0) {
+	int ret = _it->del();
+	if (ret == 0) {
+	  _fdb->_filter.remove(k);
+	  _fdb->_nrecs--;
+	}
+	return ret;
+      }
+      return _it->del();
+    }
+    int get(V *c) {
+      fp_record r;
+      int ret = _it->get(&r);
+      if (ret == 0) {
+	_fdb->from_record(r, c);
+	_fdb->_fhs.touch(r.fileid);
+      }
+      return ret;
+    }
+    int get_key(K *k) { return _it->get_key(k); }
+    int next(V *c) {
+      fp_record r;
+      int ret = _it->next(&r);
+      if (ret == 0 && c) {
+	_fdb->from_record(r, c);
+	_fdb->_fhs.touch(r.fileid);
+      }
+      return ret;
+    }
+  };
+  friend class iterator;
+
+  fp_db();
+
+  int open(const char *name);
+  int open_and_truncate(const char *name);
 
+  // as with db_base: the caller frees *iterp
+  int get_iterator(K key, iterator **iterp);
+  int get_iterator(iterator **iterp);
+
+  // size is ignored; records are all the same size
+  int add_entry(K key, V *val, int size = sizeof(V));
+  int add_entries(size_t n, const K *keys, V *vals, const int *sizes = 0);
+  // every chunk in cv[0..n), as found in version stamp of file fh
+  int add_chunks(const chunk *cv, size_t n, const nfs_fh3 &fh,
+                 u_int32_t stamp = 0);
+  // removes the records of file fh, except those of version keep if it
+  // is not 0, and returns how many went; *nchecked is bumped for each
+  // record looked at
+  u_int64_t del_fh(const nfs_fh3 &fh, u_int64_t *nchecked = 0,
+                   u_int32_t keep = 0);
+  // whether the records of file fh are of version stamp
+  bool has_fh(const nfs_fh3 &fh, u_int32_t stamp);
+  // keys of the chunks of file fh, from the reverse index; a few may
+  // name chunks whose records have since gone
+  void keys_fh(const nfs_fh3 &fh, vec<K> &keys);
+  int sync() {
+    int ret = _fhs.sync();
+    int ret2 = _db.sync();
+    int ret3 = _rev.sync();
+    return ret ? ret : ret2 ? ret2 : ret3;
+  }
+
+  // most records to keep, 0 for no limit; call before opening
+  void set_max(u_int64_t max) { _max = max; }
+  u_int64_t size() const { return _nrecs; }
+
+  // the filter counters, or NULL when there is no filter
+  const fpfilter_stats *stats() const {
+    return _filter.enabled() ? &_filter.stats : 0;
+  }
+  // warn the filter counters
+  void report(const char *who);
+};
+
+inline
+fp_db::fp_db()
+  : _fprate(0.01), _nrecs(0), _max(0)
+{
+  if (char *p = getenv("LBFS_FPFILTER"))
+    _fprate = atof(p);
+}
+
+inline void
+fp_db::build_filter()
+{
+  _filter.clear();
+  if (_fprate <= 0 && !_max)
+    return;
+
+  // keys go from the cursor straight into the filter, which is sized
+  // from the number of records with room to grow before it has to be
+  // rebuilt.  if the engine's count was short, a second pass sizes it
+  // from the count the first one took.
+  u_int64_t want = _nrecs ? _nrecs : _db.count();
+  for (int pass = 0; pass < 2; pass++) {
+    if (_fprate > 0) {
+      u_int64_t cap = 2 * want;
+      if (cap < (1 << 20))
+	cap = 1 << 20;
+      _filter.init(cap, _fprate);
+    }
+    u_int64_t n = 0;
+    fp_db_engine::iterator *it = 0;
+    if (_db.get_iterator(&it) == 0 && it) {
+      K k;
+      fp_record v;
+      do {
+	if (it->get_key(&k) == 0) {
+	  _filter.add(k);
+	  n++;
+	}
+      } while (it->next(&v) == 0);
+      delete it;
+    }
+    _nrecs = n;
+    if (!_filter.full())
+      break;
+    want = n;
+  }
+}
+
+inline int
+fp_db::open_fhs(const char *name, bool truncate)
+{
+  str fn = strbuf() << name << ".fh";
+  int ret = _fhs.open(fn, truncate);
+  if (ret)
+    warn << fn << ": " << strerror(ret) << "\n";
+  return ret;
+}
+
+inline int
+fp_db::build_rev()
+{
+  fp_db_engine::iterator *it = 0;
+  if (_db.get_iterator(&it) != 0 || !it)
+    return 0;
+  vec<K> keys;
+  vec<fp_record> recs;
+  int ret = 0;
+  fp_record r;
+  bool more = it->get(&r) == 0;
+  while (more) {
+    K k;
+    if (it->get_key(&k) == 0) {
+      keys.push_back(k);
+      recs.push_back(r);
+    }
+    more = it->next(&r) == 0;
+    if (keys.size() >= 65536 || (!more && keys.size())) {
+      if ((ret = rev_add(keys.size(), keys.base(), recs.base())))
+	break;
+      keys.clear();
+      recs.clear();
+    }
+  }
+  delete it;
+  return ret;
+}
+
+inline int
+fp_db::open_rev(const char *name, bool truncate)
+{
+  str fn = strbuf() << name << ".rev";
+  struct stat sb;
+  bool hadrev = stat(fn, &sb) == 0;
+  int ret = truncate ? _rev.open_and_truncate(fn) : _rev.open(fn);
+  if (ret == 0 && !truncate && !hadrev) {
+    warn << fn << ": rebuilding\n";
+    ret = build_rev();
+  }
+  if (ret)
+    warn << fn << ": " << strerror(ret) << "\n";
+  return ret;
+}
+
+inline int
+fp_db::open(const char *name)
+{
+  str fn = strbuf() << name << ".fh";
+  struct stat sb;
+  bool hadfhs = stat(fn, &sb) == 0;
+
+  int ret = _db.open(name);
+  if (ret == 0 && !hadfhs) {
+    // records from before the file handle table can't be read
+    fp_db_engine::iterator *it = 0;
+    if (_db.get_iterator(&it) == 0 && it) {
+      delete it;
+      warn << name << ": old format database, starting over\n";
+      ret = _db.open_and_truncate(name);
+    }
+  }
+  if (ret == 0)
+    ret = open_fhs(name, false);
+  if (ret == 0)
+    ret = open_rev(name, !hadfhs);
+  if (ret == 0)
+    build_filter();
+  return ret;
+}
+
+inline int
+fp_db::open_and_truncate(const char *name)
+{
+  int ret = _db.open_and_truncate(name);
+  if (ret == 0)
+    ret = open_fhs(name, true);
+  if (ret == 0)
+    ret = open_rev(name, true);
+  if (ret == 0)
+    build_filter();
+  return ret;
+}
+
+inline int
+fp_db::get_iterator(K key, iterator **iterp)
+{
+  if (!_filter.maybe(key)) {
+    _filter.stats.rejects++;
+    return -1;
+  }
+  fp_db_engine::iterator *it = 0;
+  if (_db.get_iterator(key, &it) != 0 || !it) {
+    if (_filter.enabled())
+      _filter.stats.falsepos++;
+    return -1;
+  }
+  if (_filter.enabled())
+    _filter.stats.hits++;
+  *iterp = New iterator(this, it);
+  return 0;
+}
+
+inline int
+fp_db::get_iterator(iterator **iterp)
+{
+  fp_db_engine::iterator *it = 0;
+  if (_db.get_iterator(&it) != 0 || !it)
+    return -1;
+  *iterp = New iterator(this, it);
+  return 0;
+}
+
+inline int
+fp_db::add_entry(K key, V *val, int)
+{
+  fp_record r;
+  if (!to_record(*val, &r))
+    return EIO;
+  int ret = _db.add_entry(key, &r);
+  if (ret == 0)
+    ret = _rev.add_entry(r.fileid, &key);
+  if (ret == 0) {
+    filter_add(1, &key);
+    grown(1);
+  }
+  return ret;
+}
+
+inline int
+fp_db::add_entries(size_t n, const K *keys, V *vals, const int *)
+{
+  fp_record *recs = New fp_record[n];
+  for (size_t i = 0; i < n; i++)
+    if (!to_record(vals[i], &recs[i])) {
+      delete[] recs;
+      return EIO;
+    }
+  int ret = _db.add_entries(n, keys, recs);
+  if (ret == 0)
+    ret = rev_add(n, keys, recs);
+  delete[] recs;
+  if (ret == 0) {
+    filter_add(n, keys);
+    grown(n);
+  }
+  return ret;
+}
+
+inline int
+fp_db::add_chunks(const chunk *cv, size_t n, const nfs_fh3 &fh,
+                  u_int32_t stamp)
+{
+  u_int32_t id = _fhs.intern(fh);
+  if (!id)
+    return EIO;
+  _fhs.touch(id);
+  K *keys = New K[n];
+  fp_record *recs = New fp_record[n];
+  for (size_t i = 0; i < n; i++) {
+    keys[i] = cv[i].hashidx();
+    recs[i].pos = cv[i].pos();
+    recs[i].count = cv[i].count();
+    recs[i].fileid = id;
+    recs[i].stamp = stamp;
+    memcpy(recs[i].hashrest, cv[i].hash().base() + sizeof(u_int64_t),
+	   FP_HASHREST);
+  }
+  int ret = _db.add_entries(n, keys, recs);
+  if (ret == 0)
+    ret = rev_add(n, keys, recs);
+  if (ret == 0) {
+    filter_add(n, keys);
+    grown(n);
+  }
+  delete[] keys;
+  delete[] recs;
+  return ret;
+}
+
+static inline int
+fp_db_keycmp(const void *a, const void *b)
+{
+  u_int64_t x = *static_cast<const u_int64_t *>(a);
+  u_int64_t y = *static_cast<const u_int64_t *>(b);
+  return x < y ? -1 : x > y;
+}
+
+inline u_int64_t
+fp_db::del_fh(const nfs_fh3 &fh, u_int64_t *nchecked, u_int32_t keep)
+{
+  u_int32_t id = _fhs.find(fh);
+  return id ? del_id(id, keep, nchecked) : 0;
+}
+
+inline u_int64_t
+fp_db::del_id(u_int32_t id, u_int32_t keep, u_int64_t *nchecked)
+{
+  if (!keep)
+    _fhs.forget(id);
+  vec<K> keys;
+  fp_rev_engine::iterator *ri = 0;
+  if (_rev.get_iterator(id, &ri) == 0 && ri) {
+    K k;
+    bool more = ri->get(&k) == 0;
+    while (more) {
+      keys.push_back(k);
+      more = ri->next(&k) == 0;
+    }
+    delete ri;
+  }
+  if (!keys.size())
+    return 0;
+
+  // a chunk that shows up several times in the file is visited once
+  qsort(keys.base(), keys.size(), sizeof(K), fp_db_keycmp);
+  vec<bool> kept;
+  kept.setsize(keys.size());
+  u_int64_t nremoved = 0;
+  for (size_t i = 0; i < keys.size(); i++) {
+    kept[i] = false;
+    if (i && keys[i] == keys[i - 1]) {
+      kept[i] = kept[i - 1];
+      continue;
+    }
+    fp_db_engine::iterator *it = 0;
+    if (_db.get_iterator(keys[i], &it) != 0 || !it)
+      continue;
+    fp_record r;
+    bool more = it->get(&r) == 0;
+    while (more) {
+      if (nchecked)
+	(*nchecked)++;
+      if (r.fileid == id) {
+	if (keep && r.stamp == keep)
+	  kept[i] = true;
+	else if (it->del() == 0) {
+	  _filter.remove(keys[i]);
+	  nremoved++;
+	}
+      }
+      more = it->next(&r) == 0;
+    }
+    delete it;
+  }
+  _nrecs -= nremoved < _nrecs ? nremoved : _nrecs;
+
+  // drop the reverse entries of keys with nothing left
+  if (_rev.get_iterator(id, &ri) == 0 && ri) {
+    K k;
+    bool more = ri->get(&k) == 0;
+    while (more) {
+      size_t lo = 0, hi = keys.size();
+      while (lo < hi) {
+	size_t mid = (lo + hi) / 2;
+	if (keys[mid] < k)
+	  lo = mid + 1;
+	else
+	  hi = mid;
+      }
+      if (lo == keys.size() || keys[lo] != k || !kept[lo])
+	ri->del();
+      more = ri->next(&k) == 0;
+    }
+    delete ri;
+  }
+  return nremoved;
+}
+
+inline void
+fp_db::evict()
+{
+  // oldest first, off the LRU list of the fh_dict; del_id takes each
+  // file off the list.  the newest file stays, however big it is, so
+  // once it is all that is left this returns straight away.
+  u_int64_t target = _max - _max / 10;
+  u_int32_t id;
+  while (_nrecs > target && (id = _fhs.oldest()) && id != _fhs.newest())
+    del_id(id, 0, 0);
+}
+
+inline bool
+fp_db::has_fh(const nfs_fh3 &fh, u_int32_t stamp)
+{
+  u_int32_t id = _fhs.find(fh);
+  if (!id)
+    return false;
+
+  // the first key that still has a record of fh decides
+  int found = -1;
+  fp_rev_engine::iterator *ri = 0;
+  if (_rev.get_iterator(id, &ri) == 0 && ri) {
+    K k;
+    bool more = ri->get(&k) == 0;
+    while (more && found < 0) {
+      fp_db_engine::iterator *it = 0;
+      if (_db.get_iterator(k, &it) == 0 && it) {
+	fp_record r;
+	bool rmore = it->get(&r) == 0;
+	while (rmore && found < 0) {
+	  if (r.fileid == id)
+	    found = r.stamp == stamp;
+	  rmore = it->next(&r) == 0;
+	}
+	delete it;
+      }
+      more = ri->next(&k) == 0;
+    }
+    delete ri;
+  }
+  return found > 0;
+}
+
+inline void
+fp_db::keys_fh(const nfs_fh3 &fh, vec<K> &keys)
+{
+  u_int32_t id = _fhs.find(fh);
+  fp_rev_engine::iterator *ri = 0;
+  if (!id || _rev.get_iterator(id, &ri) != 0 || !ri)
+    return;
+  K k;
+  bool more = ri->get(&k) == 0;
+  while (more) {
+    keys.push_back(k);
+    more = ri->next(&k) == 0;
+  }
+  delete ri;
+}
+
+inline void
+fp_db::report(const char *who)
+{
+  if (_filter.enabled())
+    _filter.stats.report(who);
+}
+
+#endif _LBFS_DB_
@@ -0,0 +1,142 @@
+#ifndef _LBFS_DB_ASYNC_
+#define _LBFS_DB_ASYNC_
+
+// fp_db for the event loop.  The database lives on a thread of its
+// own; requests made while handling one event are handed to that
+// thread as a single batch, and their callbacks run back on the event
+// loop once the batch is done.  Requests are carried out in the order
+// they were made, so a lookup never sees an add made after it.  Runs
+// of adds in a batch go into the database as one add_entries, and
+// however many syncs a batch asks for, it syncs once, at the end.
+//
+// Chunking a file can take far longer than any database request, so
+// add_file and chunk_file do their chunking on a second thread, one
+// file at a time, and the database thread only ever sees the chunks.
+// The records of add_file thus go in after requests made later.
+
+#include "async.h"
+#include "lbfsdb.h"
+#include <pthread.h>
+
+struct fp_db_op;
+
+class fp_db_async {
+public:
+  // what a lookup found, walked like an fp_db::iterator.  del() removes
+  // the current location from the database.
+  class cursor {
+    friend class fp_db_async;
+
+  private:
+    fp_db_async *_db;
+    u_int64_t _key;
+    vec<chunk_location> _locs;
+    size_t _cur;
+    cursor(fp_db_async *db, u_int64_t k) : _db(db), _key(k), _cur(0) {}
+
+  public:
+    operator bool() const { return _cur < _locs.size(); }
+    u_int64_t key() const { return _key; }
+
+    int get(chunk_location *c) {
+      if (_cur >= _locs.size())
+	return -1;
+      *c = _locs[_cur];
+      return 0;
+    }
+    int next(chunk_location *c) {
+      if (_cur >= _locs.size() || ++_cur >= _locs.size())
+	return -1;
+      if (c)
+	*c = _locs[_cur];
+      return 0;
+    }
+    void del() {
+      if (_cur < _locs.size())
+	_db->del(_key, _locs[_cur]);
+    }
+  };
+
+  // the callee frees the cursor; NULL if the key is not in the database
+  typedef callback<void, cursor *>::ref lookup_cb;
+  // chunks looked at and chunks removed
+  typedef callback<void, u_int64_t, u_int64_t>::ref del_fhs_cb;
+  typedef callback<void, const vec<u_int64_t> &>::ref keys_cb;
+  // empty if the file could not be chunked
+  typedef callback<void, const vec<chunk> &>::ref chunks_cb;
+
+  fp_db_async();
+  ~fp_db_async();
+
+  // see fp_db::set_max; call before opening
+  void set_max(u_int64_t max) { _db.set_max(max); }
+
+  // these block, and start the database thread
+  int open(const char *name);
+  int open_and_truncate(const char *name);
+
+  void lookup(u_int64_t key, lookup_cb cb);
+  void add(u_int64_t key, const chunk_location &l);
+  // every chunk in cv[0..n), as found in version stamp of file fh.
+  // if committed is given, it is called once the chunks are on disk.
+  void add_chunks(const chunk *cv, size_t n, const nfs_fh3 &fh,
+                  u_int32_t stamp = 0, cbv::ptr committed = NULL);
+  void del(u_int64_t key, const chunk_location &l);
+  // chunks the local file path, a copy of version stamp of file fh, and
+  // adds its chunks in place of whatever the database has for fh.  does
+  // nothing if the records of fh already carry stamp.
+  void add_file(const nfs_fh3 &fh, const char *path, u_int32_t stamp,
+                cbv::ptr done = NULL);
+  // chunks the local file path off the event loop and off the database
+  // thread, without touching the database
+  void chunk_file(const char *path, chunks_cb cb);
+  // the same for a file already open for reading; fd is closed once
+  // it has been read
+  void chunk_file(int fd, chunks_cb cb);
+  // removes every entry that points into one of the files fhs
+  void del_fhs(const vec<nfs_fh3> &fhs, del_fhs_cb cb);
+  // the same for one file, e.g. one whose contents just changed; the
+  // records of version keep stay, if it is not 0
+  void del_fh(const nfs_fh3 &fh, u_int32_t keep = 0);
+  // the keys of the chunks the database has of file fh
+  void keys_fh(const nfs_fh3 &fh, keys_cb cb);
+  void sync(cbv::ptr cb = NULL);
+  // warn the filter counters
+  void report(const char *who);
+
+private:
+  fp_db _db;
+
+  // event loop side
+  vec<fp_db_op *> _pending;	// not yet handed to the thread
+  bool _flushing;
+  int _wakefd[2];		// the thread writes, the event loop reads
+
+  // shared, under _lock
+  pthread_mutex_t _lock;
+  pthread_cond_t _cv;
+  pthread_cond_t _chunkcv;
+  vec<fp_db_op *> _todo;
+  vec<fp_db_op *> _tochunk;	// for the chunking thread
+  vec<fp_db_op *> _done;
+  bool _stop;
+
+  pthread_t _tid;
+  pthread_t _chunktid;
+  bool _running;
+  bool _chunking;		// the chunking thread is up
+
+  int start();
+  void enqueue(fp_db_op *op);
+  void flush();
+  void reap();
+  void finish(fp_db_op *op);
+
+  static void *thread_main(void *arg);
+  static void *chunk_main(void *arg);
+  void run_batch(vec<fp_db_op *> &batch, vec<fp_db_op *> &tochunk);
+  bool run(fp_db_op *op);
+  static void chunk_op(fp_db_op *op);
+};
+
+#endif /* _LBFS_DB_ASYNC_ */
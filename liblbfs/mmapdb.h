@@ -0,0 +1,515 @@
+#ifndef _LBFS_MMAPDB_
+#define _LBFS_MMAPDB_
+
+// A memory mapped fingerprint index with the same interface as
+// db_base.  It is kept in two files:
+//
+//   name      header and an open addressed hash table; each slot holds
+//             a key and the first entry of that key's duplicate chain
+//   name.ent  fixed size entries: key, next entry in the chain, value
+//
+// Entries never move, so iterators stay valid while the table is grown
+// or other entries are added and removed.  A full scan walks the entry
+// file in order.  New duplicates go to the front of their chain.
+// Entries are named by 32 bit indices, so there can be at most
+// MMAPDB_MAXENTS of them; everything else in the header is 64 bits.
+
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MMAPDB_MAGIC    0x4c42464d4443ULL
+#define MMAPDB_TABSIZE  (1 << 16)	// initial number of table slots
+#define MMAPDB_NENTS    (1 << 14)	// initial number of entries
+#define MMAPDB_MAXENTS  0xfffffffeU	// entry indices + 1 must not be tombstone
+
+template<class K, class V> class mmap_db {
+private:
+  struct header {
+    u_int64_t magic;
+    u_int32_t keysize;
+    u_int32_t valsize;
+    u_int64_t tabsize;		// power of two
+    u_int64_t tabused;		// slots that are not empty, tombstones too
+    u_int64_t nents;		// entries allocated in name.ent
+    u_int64_t entused;		// entries ever handed out
+    u_int64_t freelist;		// entry index + 1, 0 if none
+  };
+  struct slot {
+    K key;
+    u_int32_t head;		// entry index + 1; 0 empty
+  };
+  struct entry {
+    K key;
+    u_int32_t next;		// entry index + 1; 0 end of chain
+    u_int32_t size;		// 0 if free
+  };
+  enum { tombstone = 0xffffffff };
+  enum { entsize = (sizeof (entry) + sizeof (V) + 7) & ~7 };
+
+  str _name;
+  int _tfd;
+  int _efd;
+  header *_h;
+  char *_ents;
+  u_int64_t _nmapped;		// entries in the _ents mapping
+
+  slot *tab () const { return reinterpret_cast<slot *> (_h + 1); }
+  entry *ent (u_int32_t i) const {
+    return reinterpret_cast<entry *> (_ents + (size_t) i * entsize);
+  }
+  V *val (entry *e) const { return reinterpret_cast<V *> (e + 1); }
+
+  static size_t tabbytes (u_int64_t n) {
+    return sizeof (header) + (size_t) n * sizeof (slot);
+  }
+  static u_int64_t hash (K k, u_int64_t tabsize) {
+    u_int64_t x = 0;
+    memcpy (&x, &k, sizeof (k) < sizeof (x) ? sizeof (k) : sizeof (x));
+    // the well mixed high half of the product ends up at the bottom
+    x *= 0x9e3779b97f4a7c15ULL;
+    return (x >> 32 | x << 32) & (tabsize - 1);
+  }
+
+  slot *lookup (K k, slot **freep = NULL) const;
+  int map_table (int fd, u_int64_t tabsize, bool init);
+  int map_entries (u_int64_t nents);
+  int grow_table ();
+  void unlink_entry (u_int32_t idx);
+  void syncdir ();
+  void close ();
+
+public:
+  class iterator {
+    friend class mmap_db;
+
+  private:
+    mmap_db *_db;
+    K _key;
+    u_int32_t _cur;		// entry index + 1; 0 when done
+    u_int32_t _next;		// where to go after a del()
+    bool _duponly;
+    bool _deleted;
+    iterator (mmap_db *db, K k, u_int32_t cur, bool duponly)
+      : _db (db), _key (k), _cur (cur), _next (0),
+        _duponly (duponly), _deleted (false) {}
+    bool live () const {
+      if (!_cur || _cur > _db->_h->entused)
+	return false;
+      entry *e = _db->ent (_cur - 1);
+      return e->size && (!_duponly || e->key == _key);
+    }
+
+  public:
+    operator bool() const { return _cur != 0; }
+
+    int del() {
+      if (!live () || _deleted)
+	return -1;
+      _next = _duponly ? _db->ent (_cur - 1)->next : _cur + 1;
+      _db->unlink_entry (_cur - 1);
+      _deleted = true;
+      return 0;
+    }
+
+    // key of the current entry
+    int get_key(K *k) {
+      if (_deleted || !live ())
+	return -1;
+      *k = _db->ent (_cur - 1)->key;
+      return 0;
+    }
+
+    // get current entry
+    int get(V *c) {
+      if (_deleted || !live ()) {
+	_cur = 0;
+	return -1;
+      }
+      *c = *_db->val (_db->ent (_cur - 1));
+      return 0;
+    }
+
+    // increment iterator and get next entry
+    int next(V *c) {
+      if (!_cur)
+	return -1;
+      if (_duponly) {
+	_cur = _deleted ? _next : _db->ent (_cur - 1)->next;
+	_deleted = false;
+      }
+      else {
+	_cur = _deleted ? _next : _cur + 1;
+	_deleted = false;
+	while (_cur && _cur <= _db->_h->entused && !_db->ent (_cur - 1)->size)
+	  _cur++;
+      }
+      if (!live ()) {
+	_cur = 0;
+	return -1;
+      }
+      if (c)
+	*c = *_db->val (_db->ent (_cur - 1));
+      return 0;
+    }
+  };
+  friend class iterator;
+
+  mmap_db () : _tfd (-1), _efd (-1), _h (0), _ents (0), _nmapped (0) {}
+  ~mmap_db () { close (); }
+
+  // open db, returns an errno; flags are open(2) flags
+  int open(const char *name, u_int32_t flags = O_CREAT);
+
+  // open and truncate existing db
+  int open_and_truncate(const char *name) {
+    return open (name, O_CREAT | O_TRUNC);
+  }
+
+  // as with db_base: the caller frees *iterp
+  int get_iterator(K key, iterator **iterp);
+  int get_iterator(iterator **iterp);
+
+  // add an entry to the database, returns an errno
+  int add_entry(K key, V *val, int size = sizeof(V));
+
+  // as with db_base; the entries file grows once for the whole batch
+  int add_entries(size_t n, const K *keys, V *vals, const int *sizes = 0);
+
+  // entries ever handed out, which is at least the number of entries
+  u_int64_t count() const { return _h ? _h->entused : 0; }
+
+  // sync data to stable storage
+  int sync();
+};
+
+template<class K, class V> void
+mmap_db<K,V>::close ()
+{
+  if (_ents)
+    munmap (_ents, (size_t) _nmapped * entsize);
+  if (_h)
+    munmap (_h, tabbytes (_h->tabsize));
+  if (_tfd >= 0)
+    ::close (_tfd);
+  if (_efd >= 0)
+    ::close (_efd);
+  _h = 0;
+  _ents = 0;
+  _nmapped = 0;
+  _tfd = _efd = -1;
+}
+
+template<class K, class V> int
+mmap_db<K,V>::map_table (int fd, u_int64_t tabsize, bool init)
+{
+  size_t len = tabbytes (tabsize);
+  if (init && ftruncate (fd, len) < 0)
+    return errno;
+  void *m = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (m == MAP_FAILED)
+    return errno;
+  header *h = static_cast<header *> (m);
+  if (init) {
+    bzero (h, sizeof (*h));
+    h->magic = MMAPDB_MAGIC;
+    h->keysize = sizeof (K);
+    h->valsize = sizeof (V);
+    h->tabsize = tabsize;
+  }
+  _h = h;
+  return 0;
+}
+
+template<class K, class V> int
+mmap_db<K,V>::map_entries (u_int64_t nents)
+{
+  size_t old = (size_t) _nmapped * entsize;
+  size_t len = (size_t) nents * entsize;
+  if (len > old && ftruncate (_efd, len) < 0)
+    return errno;
+  void *m = mmap (NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, _efd, 0);
+  if (m == MAP_FAILED)
+    return errno;
+  if (_ents)
+    munmap (_ents, old);
+  _ents = static_cast<char *> (m);
+  _nmapped = nents;
+  _h->nents = nents;
+  return 0;
+}
+
+template<class K, class V> int
+mmap_db<K,V>::open (const char *name, u_int32_t flags)
+{
+  close ();
+  _name = name;
+  str ename = strbuf () << name << ".ent";
+  int oflags = O_RDWR | (flags & (O_CREAT | O_TRUNC));
+  if ((_tfd = ::open (name, oflags, 0664)) < 0
+      || (_efd = ::open (ename, oflags, 0664)) < 0) {
+    int err = errno;
+    warn << (_tfd < 0 ? name : ename.cstr ()) << ": " << strerror (err) << "\n";
+    close ();
+    return err;
+  }
+
+  struct stat sb;
+  int err;
+  if (fstat (_tfd, &sb) < 0) {
+    err = errno;
+    close ();
+    return err;
+  }
+  if (sb.st_size == 0) {
+    if ((err = map_table (_tfd, MMAPDB_TABSIZE, true))
+	|| (err = map_entries (MMAPDB_NENTS))) {
+      close ();
+      return err;
+    }
+    return 0;
+  }
+
+  header h;
+  if (pread (_tfd, &h, sizeof (h), 0) != sizeof (h)
+      || h.magic != MMAPDB_MAGIC || h.keysize != sizeof (K)
+      || h.valsize != sizeof (V)
+      || !h.tabsize || (h.tabsize & (h.tabsize - 1))
+      || h.nents > MMAPDB_MAXENTS || h.entused > h.nents
+      || (u_int64_t) sb.st_size < tabbytes (h.tabsize)) {
+    warn << name << ": not a fingerprint index\n";
+    close ();
+    return EINVAL;
+  }
+  if ((err = map_table (_tfd, h.tabsize, false))
+      || (err = map_entries (h.nents))) {
+    close ();
+    return err;
+  }
+  return 0;
+}
+
+template<class K, class V> typename mmap_db<K,V>::slot *
+mmap_db<K,V>::lookup (K k, slot **freep) const
+{
+  slot *t = tab ();
+  u_int64_t mask = _h->tabsize - 1;
+  slot *tomb = NULL;
+  for (u_int64_t i = hash (k, _h->tabsize);; i = (i + 1) & mask) {
+    slot *s = &t[i];
+    if (!s->head) {
+      if (freep)
+	*freep = tomb ? tomb : s;
+      return NULL;
+    }
+    if (s->head == tombstone) {
+      if (!tomb)
+	tomb = s;
+    }
+    else if (s->key == k)
+      return s;
+  }
+}
+
+template<class K, class V> int
+mmap_db<K,V>::grow_table ()
+{
+  // count live keys; if most slots are tombstones, rehashing at the
+  // same size is enough
+  u_int64_t live = 0;
+  for (u_int64_t i = 0; i < _h->tabsize; i++)
+    if (tab ()[i].head && tab ()[i].head != tombstone)
+      live++;
+  u_int64_t nsize = _h->tabsize;
+  if (live * 2 >= nsize)
+    nsize *= 2;
+
+  str tmp = strbuf () << _name << ".new";
+  int fd = ::open (tmp, O_RDWR | O_CREAT | O_TRUNC, 0664);
+  if (fd < 0)
+    return errno;
+  header *oh = _h;
+  int err = map_table (fd, nsize, true);
+  if (err) {
+    ::close (fd);
+    unlink (tmp);
+    _h = oh;
+    return err;
+  }
+  header *nh = _h;
+  *nh = *oh;
+  nh->tabsize = nsize;
+  nh->tabused = 0;
+  slot *ot = reinterpret_cast<slot *> (oh + 1);
+  for (u_int64_t i = 0; i < oh->tabsize; i++) {
+    if (!ot[i].head || ot[i].head == tombstone)
+      continue;
+    slot *s;
+    lookup (ot[i].key, &s);
+    *s = ot[i];
+    nh->tabused++;
+  }
+  // the new table has to be on disk before it replaces the old one,
+  // and the rename before anything is added to it
+  if (msync (nh, tabbytes (nsize), MS_SYNC) < 0 || rename (tmp, _name) < 0) {
+    err = errno;
+    munmap (nh, tabbytes (nsize));
+    ::close (fd);
+    unlink (tmp);
+    _h = oh;
+    return err;
+  }
+  syncdir ();
+  munmap (oh, tabbytes (oh->tabsize));
+  ::close (_tfd);
+  _tfd = fd;
+  return 0;
+}
+
+template<class K, class V> void
+mmap_db<K,V>::syncdir ()
+{
+  const char *slash = strrchr (_name, '/');
+  str dir = slash ? str (_name.cstr (), slash - _name.cstr () + 1) : str (".");
+  int fd = ::open (dir, O_RDONLY);
+  if (fd < 0)
+    return;
+  fsync (fd);
+  ::close (fd);
+}
+
+template<class K, class V> void
+mmap_db<K,V>::unlink_entry (u_int32_t idx)
+{
+  entry *e = ent (idx);
+  slot *s = lookup (e->key);
+  if (s) {
+    if (s->head == idx + 1)
+      s->head = e->next ? e->next : (u_int32_t) tombstone;
+    else {
+      for (u_int32_t p = s->head; p; p = ent (p - 1)->next)
+	if (ent (p - 1)->next == idx + 1) {
+	  ent (p - 1)->next = e->next;
+	  break;
+	}
+    }
+  }
+  e->size = 0;
+  e->next = (u_int32_t) _h->freelist;
+  _h->freelist = idx + 1;
+}
+
+template<class K, class V> int
+mmap_db<K,V>::get_iterator (K k, iterator **iterp)
+{
+  if (!_h)
+    return -1;
+  slot *s = lookup (k);
+  if (!s)
+    return -1;
+  *iterp = New iterator (this, k, s->head, true);
+  return 0;
+}
+
+template<class K, class V> int
+mmap_db<K,V>::get_iterator (iterator **iterp)
+{
+  if (!_h)
+    return -1;
+  for (u_int64_t i = 0; i < _h->entused; i++)
+    if (ent (i)->size) {
+      *iterp = New iterator (this, ent (i)->key, i + 1, false);
+      return 0;
+    }
+  return -1;
+}
+
+template<class K, class V> int
+mmap_db<K,V>::add_entry (K k, V *v, int size)
+{
+  assert (v);
+  assert (size > 0 && (size_t) size <= sizeof (V));
+  if (!_h)
+    return EINVAL;
+
+  int err;
+  if ((_h->tabused + 1) * 4 > _h->tabsize * 3 && (err = grow_table ()))
+    return err;
+
+  u_int32_t idx;
+  if (_h->freelist) {
+    idx = (u_int32_t) (_h->freelist - 1);
+    _h->freelist = ent (idx)->next;
+  }
+  else {
+    if (_h->entused >= MMAPDB_MAXENTS)
+      return EFBIG;
+    if (_h->entused == _h->nents
+	&& (err = map_entries (_h->nents * 2 < MMAPDB_MAXENTS
+			       ? _h->nents * 2 : MMAPDB_MAXENTS)))
+      return err;
+    idx = (u_int32_t) _h->entused++;
+  }
+
+  entry *e = ent (idx);
+  e->key = k;
+  e->size = size;
+  memcpy (val (e), v, size);
+  bzero (reinterpret_cast<char *> (val (e)) + size, sizeof (V) - size);
+
+  slot *fs;
+  slot *s = lookup (k, &fs);
+  if (s)
+    e->next = s->head;
+  else {
+    s = fs;
+    if (!s->head)
+      _h->tabused++;
+    s->key = k;
+    e->next = 0;
+  }
+  s->head = idx + 1;
+  return 0;
+}
+
+template<class K, class V> int
+mmap_db<K,V>::add_entries (size_t n, const K *keys, V *vals, const int *sizes)
+{
+  if (!_h)
+    return EINVAL;
+  int err;
+  u_int64_t want = _h->entused + n;
+  if (want > MMAPDB_MAXENTS)
+    want = MMAPDB_MAXENTS;
+  if (want > _h->nents) {
+    u_int64_t nents = _h->nents;
+    while (nents < want)
+      nents *= 2;
+    if (nents > MMAPDB_MAXENTS)
+      nents = MMAPDB_MAXENTS;
+    if ((err = map_entries (nents)))
+      return err;
+  }
+  for (size_t i = 0; i < n; i++)
+    if ((err = add_entry (keys[i], &vals[i], sizes ? sizes[i] : sizeof (V))))
+      return err;
+  return 0;
+}
+
+template<class K, class V> int
+mmap_db<K,V>::sync ()
+{
+  if (!_h)
+    return EINVAL;
+  if (msync (_ents, (size_t) _nmapped * entsize, MS_SYNC) < 0
+      || msync (_h, tabbytes (_h->tabsize), MS_SYNC) < 0)
+    return errno;
+  return 0;
+}
+
+#endif /* _LBFS_MMAPDB_ */
@@ -35,9 +35,21 @@ bool polyirreducible (u_int64_t f);
 u_int64_t polygen (u_int degree);
 
 class rabinpoly {
+protected:
+  // The lookup tables only depend on the polynomial, so they are
+  // computed once per process and shared by all rabinpoly objects.
+  struct tables {
+    u_int64_t poly;
+    int shift;
+    u_int64_t T[256];		// Lookup table for mod
+    u_int64_t U[256];		// Lookup table for removing a byte from a window
+    tables *next;
+  };
+  static const tables *gettables (u_int64_t poly);
+
+private:
   int shift;
-  u_int64_t T[256];		// Lookup table for mod
-  void calcT ();
+  const u_int64_t *T;
 public:
   const u_int64_t poly;		// Actual polynomial
 
@@ -53,7 +65,7 @@ public:
 private:
   u_int64_t fingerprint;
   int bufpos;
-  u_int64_t U[256];
+  const u_int64_t *U;
   u_char buf[size];
 
 public:
@@ -100,7 +100,7 @@ static inline int
 compare_sha1_hash(unsigned char *data, size_t count, sfs_hash &hash)
 {
   char h[sha1::hashsize];
-  sha1_hash(h, data, count);
+  lbfs_sha1_hash(h, data, count);
   return strncmp(h, hash.base(), sha1::hashsize);
 }
 
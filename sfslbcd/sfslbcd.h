@@ -36,7 +36,7 @@
 #include "aiod.h"
 #include "attrcache.h"
 
-#include "lbfsdb.h"
+#include "lbfsdb_async.h"
 #include "fingerprint.h"
 
 inline bool
@@ -173,10 +173,20 @@ protected:
   str cdir;
   bool try_compress;
   bool do_lbfs;
+  bool do_condwritev;		// cleared if the server lacks CONDWRITEV
+  bool do_getfpx;		// cleared if the server lacks GETFPX
+  bool do_getfpdata;		// cleared if the server lacks GETFPDATA
+  bool do_readchunk;		// cleared if the server lacks READCHUNK
+  bool do_getsfp;		// cleared if the server lacks GETSFP
   writeverf3 verf3;
   lbfs_attr_cache ac;
   lrucache<nfs_fh3, file_cache *> fc;
   lrucache<nfs_fh3, dir_lc *> lc; 
+  qhash<nfs_fh3, str> warmfn;	// cache files left by an earlier run
+  vec<nfs_fh3> warmq;		// files in warmfn not yet checked with fpdb
+
+  void warm_scan (int i);
+  void warm_rebuild ();
 
   void check_lbfs (void *res, clnt_stat err);
   void dispatch_dummy (svccb *sbp);
@@ -306,6 +316,13 @@ protected:
 
   void file_cache_insert (nfs_fh3 fh) {
     file_cache *f = New file_cache(fh);
+    // a copy from before a restart is as good as a previous version
+    if (str *w = warmfn[fh]) {
+      f->prevfn = *w;
+      warmfn.remove(fh);
+    }
+    else
+      f->prevfn = "";
     fc.insert(fh,f);
   }
 
@@ -340,8 +357,9 @@ public:
                  sfs_aid aid, void *arg, void *res);
 
   static unsigned tmpfd;
-  static fp_db fpdb;
+  static fp_db_async fpdb;
   static void db_sync ();
+  static void db_synced ();
 };
 
 void lbfs_read (file_cache *fe, uint64 size, ref<server> srv,
@@ -23,6 +23,7 @@
 #define SFSRWSD_H
 
 #include "qhash.h"
+#include "list.h"
 #include "arpc.h"
 #include "vec.h"
 #include "getfh3.h"
@@ -36,7 +37,7 @@
 #include "sfsserv.h"
 #include "lbfs_prot.h"
 #include "lbfs.h"
-#include "lbfsdb.h"
+#include "lbfsdb_async.h"
 #include "fingerprint.h"
 #include "axprt_compress.h"
 
@@ -138,6 +139,131 @@ struct trash_dir {
   unsigned nactive;
 };
 
+//
+// per file chunk lists handed out by GETFP, valid as long as the file
+// still has the mtime and size the list was computed from
+//
+
+#define FPCACHE_MAX (1<<20)     // default number of cached fingerprints
+#define FPMANIFEST_MAX (1<<16)  // default number of manifests kept on disk
+
+struct fpcache_entry {
+  const nfs_fh3 fh;
+  nfstime3 mtime;
+  u_int64_t size;
+  u_int64_t end;                // fprints cover [0, end)
+  bool complete;                // end is the end of the file
+  vec<lbfs_fp3> fprints;
+  vec<u_int64_t> offsets;       // file offset of each fprint
+  SuperChunker supers;          // over fprints[0, nsupered)
+  size_t nsupered;
+
+  ihash_entry<fpcache_entry> hlink;
+  tailq_entry<fpcache_entry> lrulink;
+
+  fpcache_entry (const nfs_fh3 &f, const nfstime3 &m, u_int64_t s);
+
+  // fingerprints of chunks in [off, off+count), at most max of them.
+  // returns false if the cached list can not answer the request.
+  bool getfp (u_int64_t off, u_int32_t count, size_t max,
+              vec<lbfs_fp3> &fps, bool *eof);
+  // fingerprints index through index+count-1 and the offset of the
+  // first. returns false if the list does not reach that far yet.
+  bool getfpx (u_int32_t index, u_int32_t count,
+               vec<lbfs_fp3> &fps, u_int64_t *off, bool *eof);
+  // super-chunks index through index+count-1, likewise
+  bool getsfp (u_int32_t index, u_int32_t count,
+               vec<superchunk> &sv, u_int64_t *off, bool *eof);
+  // add the first n chunks of cv at the end of the list
+  void append (const vec<chunk> &cv, size_t n, bool eof);
+};
+
+class fpcache {
+  size_t nfprints;
+  ihash<const nfs_fh3, fpcache_entry,
+        &fpcache_entry::fh, &fpcache_entry::hlink, hashfh3> tab;
+  tailq<fpcache_entry, &fpcache_entry::lrulink> lru;
+  str mfdir;                    // where complete lists are kept on disk
+  size_t nmanifests;
+
+  void remove (fpcache_entry *e);
+  void trim (fpcache_entry *keep);
+  str manifest_path (const nfs_fh3 &fh);
+  void unlink_manifest (const str &path);
+  bool manifest_matches (const nfs_fh3 &fh, const nfstime3 &mtime,
+                         u_int64_t size);
+  fpcache_entry *load (const nfs_fh3 &fh, const nfstime3 &mtime,
+                       u_int64_t size);
+  void save (fpcache_entry *e);
+
+public:
+  size_t maxfprints;
+  size_t maxmanifests;
+
+  fpcache () : nfprints (0), nmanifests (0), maxfprints (FPCACHE_MAX),
+               maxmanifests (FPMANIFEST_MAX) {}
+  void setdir (str dir);
+
+  // looks in memory first, then for a manifest on disk
+  fpcache_entry *lookup (const nfs_fh3 &fh, const nfstime3 &mtime,
+                         u_int64_t size);
+  // append the first n chunks of cv, which start at off, to the list
+  // for fh. the list is only extended at its current end.
+  void insert (const nfs_fh3 &fh, const nfstime3 &mtime, u_int64_t size,
+               u_int64_t off, const vec<chunk> &cv, size_t n, bool eof);
+  // replace the list for fh with the complete list cv
+  void commit (const nfs_fh3 &fh, const nfstime3 &mtime, u_int64_t size,
+               const vec<chunk> &cv);
+
+  // drop the in-memory list and the manifest if they do not match
+  // attributes a
+  void expire (const nfs_fh3 &fh, const ex_fattr3 *a);
+  // drop both the in-memory list and the manifest
+  void invalidate (const nfs_fh3 &fh);
+  // remove the oldest manifests once there are more than maxmanifests
+  void sweep ();
+};
+
+//
+// data of recently read chunks, by hash, for READCHUNK.  each entry
+// remembers the file it was read from, so a caller can be checked for
+// read access to that file before it gets the data.
+//
+
+#define CHUNKCACHE_MAX (64<<20)	// default bytes of cached chunk data
+
+struct chunkcache_entry {
+  const u_int64_t key;		// hashidx of the chunk
+  sfs_hash hash;
+  nfs_fh3 file;			// the data was read from
+  str data;
+
+  ihash_entry<chunkcache_entry> hlink;
+  tailq_entry<chunkcache_entry> lrulink;
+
+  chunkcache_entry (u_int64_t k) : key (k) {}
+};
+
+class chunkcache {
+  size_t nbytes;
+  ihash<const u_int64_t, chunkcache_entry,
+        &chunkcache_entry::key, &chunkcache_entry::hlink> tab;
+  tailq<chunkcache_entry, &chunkcache_entry::lrulink> lru;
+
+  void remove (chunkcache_entry *e);
+
+public:
+  size_t maxbytes;
+  u_int64_t hits;
+  u_int64_t misses;
+
+  chunkcache () : nbytes (0), maxbytes (CHUNKCACHE_MAX), hits (0), misses (0) {}
+  // the data of the chunk, or NULL; *file is where it was read from
+  str lookup (const sfs_hash &hash, size_t count, nfs_fh3 *file);
+  void insert (const sfs_hash &hash, const unsigned char *data, size_t count,
+               const nfs_fh3 &file);
+};
+
 class erraccum;
 struct synctab;
 class filesrv {
@@ -212,7 +338,8 @@ private:
   void make_trashent_lookup_cb(unsigned, unsigned, 
                                lookup3res *res, clnt_stat err);
   void make_trashent_remove_cb(wccstat3 *res, clnt_stat err);
-  void db_gc(fp_db::iterator *);
+  void db_gc();
+  void db_gc_done(size_t nfhs, u_int64_t nchunks, u_int64_t nremoved);
   bool db_is_dirty;
 
 public:
@@ -227,8 +354,11 @@ public:
 
   filesrv ();
   
-  fp_db fpdb;
+  fp_db_async fpdb;
   void db_dirty();
+
+  fpcache fpc;
+  chunkcache hotc;
 };
 
 extern int sfssfd;
@@ -265,17 +395,136 @@ void nfs3_copy (ref<aclnt> c, AUTH *auth,
                 callback<void, commit3res *, str>::ref cb,
 		bool in_order = true);
 
+// same as nfs3_copy, but if src and dst can be opened on a local file
+// system, clones or copies the data there instead of through NFS. rcb
+// is only called if we end up falling back to nfs3_copy.
+void nfs3_copy_local (ref<aclnt> c, AUTH *auth, const filesys &fs,
+                      const nfs_fh3 &src, const nfs_fh3 &dst, 
+                      callback<void, const unsigned char *, size_t, off_t>::ref rcb,
+                      callback<void, commit3res *, str>::ref cb);
+
+// open a file handle of fs directly, returns -1 and sets errno if fs is
+// not local or the platform cannot open file handles.
+int localfs_open (const filesys &fs, const nfs_fh3 &fh, int flags);
+
+// read from a file handle of fs through a pool of cached local file
+// descriptors. returns -1 if the file cannot be read locally, in which
+// case the caller should use NFS.
+ssize_t localfs_pread (const filesys &fs, const nfs_fh3 &fh,
+                       void *buf, size_t count, off_t pos);
+// close any cached descriptor for fh, e.g. because the file was removed
+void localfs_forget (const nfs_fh3 &fh);
+
 // issues multiple concurrent NFS write requests to server.
 void nfs3_write (ref<aclnt> c, AUTH *auth, const nfs_fh3 &fh, 
                  callback<void, write3res *, str>::ref cb,
 		 unsigned char *data, off_t pos, uint32 count, stable_how s);
 
+// a search for a copy of a chunk.  found gets the data, which it then
+// owns, and the file it came from, or NULL if no file had the chunk.
+struct chunk_find_req {
+  sfs_hash hash;
+  uint32 count;
+  nfs_fh3 skip;			// not worth reading, e.g. the file written
+  bool hinted;			// try hint at hint_pos first
+  bool check_access;		// only files aui may read will do
+  nfs_fh3 hint;
+  u_int64_t hint_pos;
+  u_int32_t aui;
+  filesrv::reqstate rqs;
+  nfs_fh3 from;
+  callback<void, unsigned char *, const nfs_fh3 &>::ptr found;
+
+  chunk_find_req ()
+    : count (0), hinted (false), check_access (false), hint_pos (0),
+      aui (0) {}
+};
+
+// one chunk of a CONDWRITE or CONDWRITEV. done gets the write3res if a
+// copy of the chunk was written, otherwise NULL and the reason.
+struct condwrite_req {
+  typedef callback<void, nfsstat3, write3res *>::ref cb_t;
+
+  unsigned fd;
+  uint64 offset;
+  uint32 count;
+  sfs_hash hash;
+  u_int32_t aui;
+  filesrv::reqstate rqs;
+  cb_t done;
+
+  condwrite_req (unsigned fd, const lbfs_cwchunk &c, u_int32_t aui,
+                 filesrv::reqstate rqs, cb_t done)
+    : fd (fd), offset (c.offset), count (c.count), hash (c.hash),
+      aui (aui), rqs (rqs), done (done) {}
+};
+
+// a CONDWRITEV waiting for its chunks
+struct condwritev_state {
+  svccb *sbp;
+  filesrv::reqstate rqs;
+  size_t left;
+  nfsstat3 err;
+  lbfs_condwritev3res *res;
+};
+
+// READCHUNKs of one chunk waiting for the same search
+struct readchunk_fetch {
+  const u_int64_t key;		// hashidx of the chunk
+  sfs_hash hash;
+  uint32 count;
+  u_int32_t aui;		// whose read access the search checks
+  bool listed;			// in the client's rcfetch table
+  vec<svccb *> sbps;
+  vec<filesrv::reqstate> rqss;
+  ihash_entry<readchunk_fetch> hlink;
+
+  readchunk_fetch (u_int64_t k)
+    : key (k), count (0), aui (0), listed (false) {}
+};
+
+// a GETFPDATA reply waiting for chunk data
+struct getfpdata_state {
+  svccb *sbp;
+  filesrv::reqstate rqs;
+  size_t left;
+  lbfs_getfpdata3res *res;
+};
+
+// a file being chunked for GETFPX, a segment at a time and a little
+// ahead of the requests waiting on it
+struct getfpx_stream {
+  struct waiter {
+    svccb *sbp;
+    filesrv::reqstate rqs;
+  };
+
+  const nfs_fh3 fh;
+  fattr3 attr;
+  filesrv::reqstate rqs;
+  u_int32_t aui;
+  fpcache_entry list;
+  u_int32_t want;		// end of the furthest window asked for
+  bool stale;			// the file changed under us
+  vec<waiter> waiting;
+  ihash_entry<getfpx_stream> hlink;
+
+  getfpx_stream (const nfs_fh3 &f, const fattr3 &a,
+                 filesrv::reqstate rqs, u_int32_t aui)
+    : fh (f), attr (a), rqs (rqs), aui (aui), list (f, a.mtime, a.size),
+      want (0), stale (false) {}
+};
+
 
 class client : public virtual refcount, public sfsserv {
   filesrv *fsrv;
 
   ptr<asrv> nfssrv;
   ufd_table ufdtab;
+  ihash<const nfs_fh3, getfpx_stream,
+        &getfpx_stream::fh, &getfpx_stream::hlink, hashfh3> fpxtab;
+  ihash<const u_int64_t, readchunk_fetch,
+        &readchunk_fetch::key, &readchunk_fetch::hlink> rcfetch;
 
   static u_int64_t nextgen ();
 
@@ -298,15 +547,43 @@ class client : public virtual refcount, public sfsserv {
   void trashent_lookup_cb (svccb *sbp, filesrv::reqstate rqs,
                            lookup3res *, clnt_stat err);
 
-  void condwrite_write_cb (svccb *sbp, filesrv::reqstate rqs, size_t count,
-                           write3res *, str err);
-  void condwrite_got_chunk (svccb *sbp, filesrv::reqstate rqs,
-		            fp_db::iterator * iter, Chunker*,
-			    unsigned char *data, 
-			    size_t count, read3res *, str err);
+  void chunk_find (chunk_find_req *f);
+  void chunk_find_lookup (chunk_find_req *f);
+  void chunk_find_lookup_cb (chunk_find_req *f, fp_db_async::cursor *iter);
+  void chunk_find_read (chunk_find_req *f, fp_db_async::cursor *iter,
+                        const nfs_fh3 &fh, const chunk_location &c);
+  void chunk_find_access_cb (chunk_find_req *f, fp_db_async::cursor *iter,
+                             nfs_fh3 fh, chunk_location c,
+                             access3res *ares, clnt_stat err);
+  void chunk_find_fetch (chunk_find_req *f, fp_db_async::cursor *iter,
+                         const nfs_fh3 &fh, const chunk_location &c);
+  void chunk_find_got (chunk_find_req *f, fp_db_async::cursor *iter,
+                       nfs_fh3 fh, Chunker*, unsigned char *data,
+		       size_t count, read3res *, str err);
+  void chunk_find_next (chunk_find_req *f, fp_db_async::cursor *iter);
+  void chunk_find_done (chunk_find_req *f, unsigned char *data);
   void condwrite_read_cb (unsigned char *, off_t, Chunker*,
                           const unsigned char *, size_t, off_t);
+
+  void condwrite_start (condwrite_req *r);
+  void condwrite_found (condwrite_req *r, unsigned char *data,
+                        const nfs_fh3 &);
+  void condwrite_done (condwrite_req *r, nfsstat3 status, write3res *res);
+  void condwrite_write_cb (condwrite_req *r, write3res *, str err);
   void condwrite (svccb *sbp, filesrv::reqstate rqs);
+  void condwrite_reply (svccb *sbp, filesrv::reqstate rqs,
+                        nfsstat3 status, write3res *res);
+  void condwritev (svccb *sbp, filesrv::reqstate rqs);
+  void condwritev_chunk (condwritev_state *st, size_t i,
+                         nfsstat3 status, write3res *);
+
+  void readchunk (svccb *sbp, filesrv::reqstate rqs);
+  void readchunk_cached_cb (svccb *sbp, filesrv::reqstate rqs, str data,
+                            access3res *ares, clnt_stat err);
+  void readchunk_search (svccb *sbp, filesrv::reqstate rqs);
+  void readchunk_found (readchunk_fetch *fetch, unsigned char *data,
+                        const nfs_fh3 &from);
+  void readchunk_reply (svccb *sbp, filesrv::reqstate rqs, str data);
 
   void tmpwrite_cb (svccb *sbp, filesrv::reqstate rqs,
                     write3res *wres, clnt_stat err);
@@ -320,15 +597,38 @@ class client : public virtual refcount, public sfsserv {
                    size_t count, off_t pos);
   void movetmp_cb (rename3res *res, clnt_stat err);
   void removetmp_cb (wccstat3 *, clnt_stat err);
-  void committmp_cb (svccb *sbp, filesrv::reqstate rqs,
+  void committmp_cb (svccb *sbp, filesrv::reqstate rqs, Chunker *,
                      commit3res *res, str err);
+  void committmp_chunked (nfs_fh3 fh, nfstime3 mtime, u_int64_t size,
+                          const vec<chunk> &cv);
   void committmp (svccb *sbp, filesrv::reqstate rqs);
   
   void aborttmp (svccb *sbp, filesrv::reqstate rqs);
  
   void getfp_cb (svccb *sbp, filesrv::reqstate rqs, Chunker *, 
                  size_t count, read3res *, str err);
+  void getfp_access_cb (svccb *sbp, filesrv::reqstate rqs,
+                        access3res *, clnt_stat err);
   void getfp (svccb *sbp, filesrv::reqstate rqs);
+  bool getsfp_answer (svccb *sbp, filesrv::reqstate rqs,
+                      fpcache_entry *e, const post_op_attr &pa);
+  bool getfpx_answer (svccb *sbp, filesrv::reqstate rqs,
+                      fpcache_entry *e, const fattr3 &a);
+  void getfpdata_fill (svccb *sbp, filesrv::reqstate rqs,
+                       const vec<lbfs_fp3> &fps, u_int64_t off, bool eof,
+		       const post_op_attr &pa);
+  void getfpdata_copy (getfpdata_state *st, size_t i, u_int64_t pos0,
+                       const unsigned char *data, size_t count, off_t pos);
+  void getfpdata_read_cb (getfpdata_state *st, size_t i,
+                          size_t count, read3res *, str err);
+  void getfpdata_check (getfpdata_state *st, size_t i, ssize_t n);
+  void getfpdata_done (getfpdata_state *st);
+  void getfpx_step (getfpx_stream *s);
+  void getfpx_read_cb (getfpx_stream *s, Chunker *, 
+                       size_t count, read3res *, str err);
+  void getfpx_access_cb (svccb *sbp, filesrv::reqstate rqs,
+                         access3res *ares, clnt_stat err);
+  void getfpx (svccb *sbp, filesrv::reqstate rqs);
 
 protected:
   explicit client (ref<axprt_zcrypt> x);